@@ -1,53 +1,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <time.h>
 #include <getopt.h>
 #include <string.h>
+#include <strings.h>
 #include <png.h>
 #include <libnsbmp.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libcirclefit.h"
 
 #define BMP_BYTES_PER_PIXEL (sizeof(uint32_t))
-#define SQUARE(x) ((x) * (x))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-typedef struct color_t {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} color;
-typedef color pixel;
+// rows rendered at a time before handing them to the output writer
+#define BAND_ROWS 64
 
-typedef struct {
-    union {
-        struct color_t; // MS extension
-        pixel pix3;
-    };
-    uint8_t a;
-} pixel4;
-
-typedef struct circle_t {
-    int x;
-    int y;
-    int r;
-} circle;
-
-typedef struct {
-    union {
-        struct circle_t; // MS extension
-        circle cir;
-    };
-    bool alive;
-} box;
+typedef cf_color color;
+typedef color pixel;
 
-typedef enum { UNKNOWN, BMP, PNG, RAW } image_format_t;
+// RAW is 24bpp RGB, BGRA is 32bpp bytes in B, G, R, A order, and XRGB is a
+// native-endian 32bpp word 0xXXRRGGBB (DRM/Wayland XRGB8888)
+typedef enum { UNKNOWN, BMP, PNG, RAW, BGRA, XRGB } image_format_t;
 image_format_t input_format;
 
-int nboxes;
-box *boxes;
-
 int img_width;
 int img_height;
 
@@ -65,122 +49,37 @@ bmp_bitmap_callback_vt bmp_callbacks = {
     bmp_cb_get_buffer
 };
 
-pixel *outbuf;
+// raw input pixels, sampled in place when coloring
+const uint8_t *orig_raw;
+size_t orig_raw_stride;
 
-color getpixel(int x, int y) {
-    if (input_format == PNG) {
-        // bytes per memory row = components per row * bytes per component
-        int stride = PNG_IMAGE_ROW_STRIDE(orig_png) *
-            PNG_IMAGE_PIXEL_COMPONENT_SIZE(orig_png.format);
-        // pixels per memory row = bytes per row / bytes per pixel
-        int pitch = stride/PNG_IMAGE_PIXEL_SIZE(orig_png.format);
-        return orig_png_buf[y*pitch + x];
-    } else if (input_format == BMP) {
-        // pixels per memory row = image width
-        int pitch = orig_bmp.width;
-        return ((pixel4 *)(orig_bmp.bitmap))[y*pitch + x].pix3;
-    }
-    return (color){0x00, 0x00, 0x00};
-}
-
-void putpixel(int x, int y, color c) {
-    // for the output, pixels per memory row is known to be image width
-    int pitch = img_width;
-    outbuf[y*pitch + x] = c;
-}
+// input file or fd mapped read-only, if any
+void *input_map;
+size_t input_map_size;
 
-void xline(int xa, int xb, int y, color c) {
-    if (xa > xb)
-        return;
-    for (int i = xa; i <= xb; i++) {
-        putpixel(i, y, c);
-    }
-}
-
-// draw points in all 8 symmetric octants of a circle
-void draw_circle_octant_points(int cx, int cy, int x, int y, color c) {
-    // quadrants of circle
-    putpixel(cx + x, cy + y, c);
-    putpixel(cx + x, cy - y, c);
-    putpixel(cx - x, cy + y, c);
-    putpixel(cx - x, cy - y, c);
-    if (x != y) {
-        // also do octants by swapping x and y
-        putpixel(cx + y, cy + x, c);
-        putpixel(cx + y, cy - x, c);
-        putpixel(cx - y, cy + x, c);
-        putpixel(cx - y, cy - x, c);
-    }
-}
+pixel *outbuf;
 
-// fill a circle using octants
-void fill_circle_octant_points(int cx, int cy, int x, int y, color c) {
-    // quadrants of circle
-    xline(cx - x, cx + x, cy + y, c);
-    xline(cx - x, cx + x, cy - y, c);
-    if (x != y) {
-        // also do octants by swapping x and y
-        xline(cx - y, cx + y, cy + x, c);
-        xline(cx - y, cx + y, cy - x, c);
-    }
+// all buffers of the run, freed at once when done
+cf_arena *arena;
 
-}
+// circle layout, done by the placement thread
+cf_context *ctx;
+cf_result placement_result;
+pthread_t placement_thread;
+bool placement_started;
 
-// Bresenham Circle Drawing Algorithm
-// https://funloop.org/post/2021-03-15-bresenham-circle-drawing-algorithm.html
-// CAUTION: No bounds checking
-void draw_circle(bool fill, circle cir, color col) {
-    // Calculation coordinates are based on (0, 0) at center, math polarity.
-    // Start in standard position.
-    int x = cir.r;
-    int y = 0;
-
-    // F = distance from true circle
-    int F = 1 - cir.r; // approx for (r - 0.5, 1)
-    // dN and dNW = how much F will change when going the respective direction
-    int dN = 3;
-    int dNW = 5 - (2 * cir.r);
-
-    // first point
-    if (fill)
-        fill_circle_octant_points(cir.x, cir.y, x, y, col);
-    else
-        draw_circle_octant_points(cir.x, cir.y, x, y, col);
-
-    while (x > y) {
-        if (F <= 0) {
-            // Northwest would go too far inside the circle, go north instead.
-            // X remains the same.
-            // Update F: increases by dN
-            F += dN;
-            // Update dN and dNW
-            dN += 2;
-            dNW += 2;
-        } else {
-            // Go northwest by default.
-            x--;
-            // Update F: increases by dNW
-            F += dNW;
-            // Update dN and dNW
-            dN += 2;
-            dNW += 4;
-        }
-        y++;
-        if (fill)
-            fill_circle_octant_points(cir.x, cir.y, x, y, col);
-        else
-            draw_circle_octant_points(cir.x, cir.y, x, y, col);
-    }
-}
+// in animation mode placement runs tick by tick alongside rendering instead
+bool animate;
 
-// Draw a box with fill and edge colors
-void draw_box(box *b, color fill, color edge) {
-    draw_circle(true, b->cir, fill);
-    draw_circle(false, b->cir, edge);
-}
+// output bands finished by the renderer, consumed by the writer thread
+FILE *output_fp;
+int bands_rendered;
+pthread_mutex_t bands_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bands_cond = PTHREAD_COND_INITIALIZER;
 
-// Read a PNG format image from stdin into buf
-void read_png_stdio(png_image *image, pixel **buf) {
+// Start reading a PNG format image from stdin
+// The image size is known once this returns
+void begin_read_png_stdio(png_image *image) {
     image->version = PNG_IMAGE_VERSION;
     image->opaque = NULL;
 
@@ -188,41 +87,44 @@ void read_png_stdio(png_image *image, pixel **buf) {
         fprintf(stderr, "Failed to read PNG from stdin\n");
         exit(EXIT_FAILURE);
     }
+}
 
-    image->format = PNG_FORMAT_RGB;
-
-    *buf = calloc(1, PNG_IMAGE_SIZE(*image));
-    if (!*buf) {
-        fprintf(stderr, "Failed to allocate %u bytes\n", PNG_IMAGE_SIZE(*image));
-        exit(EXIT_FAILURE);
-    }
+// Start reading a PNG format image from path
+// The image size is known once this returns
+void begin_read_png_file(png_image *image, char *path) {
+    image->version = PNG_IMAGE_VERSION;
+    image->opaque = NULL;
 
-    if (!png_image_finish_read(image, NULL, *buf, 0, NULL)) {
-        fprintf(stderr, "Failed to read PNG from stdin\n");
+    if (!png_image_begin_read_from_file(image, path)) {
+        fprintf(stderr, "Failed to read PNG from '%s'\n", path);
         exit(EXIT_FAILURE);
     }
 }
 
-// Read a PNG format image from path into buf
-void read_png_file(png_image *image, pixel **buf, char *path) {
+// Start reading a PNG format image from memory
+// The image size is known once this returns
+void begin_read_png_memory(png_image *image, void *data, size_t size) {
     image->version = PNG_IMAGE_VERSION;
     image->opaque = NULL;
 
-    if (!png_image_begin_read_from_file(image, path)) {
-        fprintf(stderr, "Failed to read PNG from '%s'\n", path);
+    if (!png_image_begin_read_from_memory(image, data, size)) {
+        fprintf(stderr, "Failed to read PNG from memory\n");
         exit(EXIT_FAILURE);
     }
+}
 
+// Finish reading a PNG format image started by begin_read_png_* into buf
+void finish_read_png(png_image *image, pixel **buf) {
     image->format = PNG_FORMAT_RGB;
 
-    *buf = calloc(1, PNG_IMAGE_SIZE(*image));
+    *buf = cf_arena_alloc(arena, PNG_IMAGE_SIZE(*image));
     if (!*buf) {
         fprintf(stderr, "Failed to allocate %u bytes\n", PNG_IMAGE_SIZE(*image));
         exit(EXIT_FAILURE);
     }
 
     if (!png_image_finish_read(image, NULL, *buf, 0, NULL)) {
-        fprintf(stderr, "Failed to read PNG from '%s'\n", path);
+        fprintf(stderr, "Failed to decode PNG image\n");
         exit(EXIT_FAILURE);
     }
 }
@@ -241,97 +143,172 @@ void write_png_file(pixel **buf, int width, int height, char *path) {
     // error checking in here
 }
 
-// Read a file into newly allocated memory
+// Map an open file descriptor read-only
 // Sets size to the file size
-char *read_file(char *path, size_t *size) {
-    FILE *fd = fopen(path, "rb");
-    if (!fd) {
-        fprintf(stderr, "Failed to open file %s for reading\n", path);
+void *map_fd(int fd, size_t *size) {
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        fprintf(stderr, "Failed to stat fd %d\n", fd);
         exit(EXIT_FAILURE);
     }
-
-    struct stat sb;
-    if (stat(path, &sb)) {
-        fprintf(stderr, "Failed to stat file %s\n", path);
+    if (sb.st_size <= 0) {
+        fprintf(stderr, "Nothing to map on fd %d\n", fd);
         exit(EXIT_FAILURE);
     }
     *size = sb.st_size;
 
-    void *buffer = malloc(*size);
+    void *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %zu bytes from fd %d: %s\n", *size, fd,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    return map;
+}
+
+// Map a file read-only
+// Sets size to the file size
+void *map_file(char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s for reading\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    void *map = map_fd(fd, size);
+
+    // the mapping stays valid after the fd is closed
+    close(fd);
+    return map;
+}
+
+// Read exactly size bytes from stdin into memory allocated from the arena
+char *read_stdio(size_t size) {
+    char *buffer = cf_arena_alloc(arena, size);
     if (!buffer) {
-        fprintf(stderr, "Failed to allocate %zu bytes\n", *size);
+        fprintf(stderr, "Failed to allocate %zu bytes\n", size);
         exit(EXIT_FAILURE);
     }
 
-    size_t nread = fread(buffer, 1, *size, fd);
-    if (nread != *size) {
-        fprintf(stderr, "Unable to read %zu bytes, got %zu\n", *size, nread);
+    size_t nread = fread(buffer, 1, size, stdin);
+    if (nread != size) {
+        fprintf(stderr, "Unable to read %zu bytes from stdin, got %zu\n",
+                size, nread);
         exit(EXIT_FAILURE);
     }
 
-    fclose(fd);
     return buffer;
 }
 
-// Write a file to disk
-void write_file(void *data, size_t size, char *path) {
+// Open a file on disk for writing
+FILE *open_output(char *path) {
     FILE *fd = fopen(path, "wb");
     if (!fd) {
         fprintf(stderr, "Failed to open file %s for writing\n", path);
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
 
-    size_t nwritten = fwrite(data, 1, size, fd);
-    if (nwritten != size) {
-        fprintf(stderr, "Unable to write %zu bytes, wrote %zu\n", size, nwritten);
-        exit(EXIT_FAILURE);
+// Write raw output bands to output_fp as soon as they are rendered
+void *write_raw_bands(void *arg) {
+    (void)arg;
+    int written = 0; // rows written so far
+
+    while (written < img_height) {
+        pthread_mutex_lock(&bands_lock);
+        while (bands_rendered * BAND_ROWS <= written) {
+            pthread_cond_wait(&bands_cond, &bands_lock);
+        }
+        int ready = MIN(bands_rendered * BAND_ROWS, img_height);
+        pthread_mutex_unlock(&bands_lock);
+
+        // write every finished band in one go
+        size_t count = (size_t)(ready - written) * img_width;
+        size_t nwritten = fwrite(outbuf + (size_t)written * img_width,
+                sizeof(pixel), count, output_fp);
+        if (nwritten != count) {
+            fprintf(stderr, "Unable to write %zu pixels, wrote %zu\n",
+                    count, nwritten);
+            exit(EXIT_FAILURE);
+        }
+        written = ready;
     }
 
-    fclose(fd);
+    return NULL;
 }
 
-// Read a BMP file from stdin into newly allocated memory
+// Get the image size from the start of a BMP file
+// Returns false if the header is too short or not understood
+bool bmp_header_size(const uint8_t *header, size_t len, int *width, int *height) {
+    if (len < 26) {
+        return false;
+    }
+
+    uint32_t info_size = header[14] | (header[15] << 8) |
+        (header[16] << 16) | ((uint32_t)header[17] << 24);
+    if (info_size == 12) {
+        // BITMAPCOREHEADER, 16-bit unsigned dimensions
+        *width = header[18] | (header[19] << 8);
+        *height = header[20] | (header[21] << 8);
+    } else if (info_size >= 40) {
+        // BITMAPINFOHEADER and later, 32-bit signed dimensions
+        // negative height means top-down row order
+        *width = (int32_t)(header[18] | (header[19] << 8) |
+                (header[20] << 16) | ((uint32_t)header[21] << 24));
+        *height = abs((int32_t)(header[22] | (header[23] << 8) |
+                (header[24] << 16) | ((uint32_t)header[25] << 24)));
+    } else {
+        return false;
+    }
+    return *width > 0 && *height > 0;
+}
+
+// Read a BMP file from stdin into memory allocated from the arena
 // Sets size to the file size
-char *read_bmp_stdio(size_t *size) {
-    // Read the first 2 bytes and check the signature
-    uint16_t signature;
-    if (fread(&signature, sizeof(uint16_t), 1, stdin) != 1) {
-        fprintf(stderr, "Failed to read BMP signature from stdin\n");
+// Calls on_header with the image size, if known, before reading the pixels
+char *read_bmp_stdio(size_t *size, void (*on_header)(int width, int height)) {
+    // Read the file header and start of the info header
+    uint8_t header[26];
+    if (fread(header, 1, sizeof(header), stdin) != sizeof(header)) {
+        fprintf(stderr, "Failed to read BMP header from stdin\n");
         exit(EXIT_FAILURE);
     }
-    if ((signature & 0xFF) != 'B' || ((signature >> 8) & 0xFF) != 'M') {
+    if (header[0] != 'B' || header[1] != 'M') {
         fprintf(stderr, "Incorrect BMP signature on stdin\n");
         exit(EXIT_FAILURE);
     }
 
-    // Read the next 4 bytes for the file size
-    uint32_t filesize;
-    if (fread(&filesize, sizeof(uint32_t), 1, stdin) != 1) {
-        fprintf(stderr, "Failed to read BMP filesize from stdin\n");
+    // The next 4 bytes are the file size
+    uint32_t filesize = header[2] | (header[3] << 8) |
+        (header[4] << 16) | ((uint32_t)header[5] << 24);
+    if (filesize < sizeof(header)) {
+        fprintf(stderr, "Invalid BMP filesize %u on stdin\n", filesize);
         exit(EXIT_FAILURE);
     }
     *size = filesize;
 
-    // allocate memory for the rest of the file
-    char *buffer = malloc(*size);
+    int width, height;
+    if (bmp_header_size(header, sizeof(header), &width, &height)) {
+        on_header(width, height);
+    }
+
+    // allocate memory for the whole file
+    char *buffer = cf_arena_alloc(arena, *size);
     if (!buffer) {
         fprintf(stderr, "Failed to allocate %zu bytes\n", *size);
         exit(EXIT_FAILURE);
     }
 
     // fill in what we already read
-    buffer[0] = 'B';
-    buffer[1] = 'M';
-    buffer[2] = (filesize >> 24) & 0xFF;
-    buffer[3] = (filesize >> 16) & 0xFF;
-    buffer[4] = (filesize >> 8) & 0xFF;
-    buffer[5] = filesize & 0xFF;
+    memcpy(buffer, header, sizeof(header));
 
     // read the rest of the file
-    size_t nread = fread(buffer + 6, 1, filesize - 6, stdin);
-    if (nread != filesize - 6) {
-        fprintf(stderr, "Unable to read %u remaining bytes, got %zu\n",
-                filesize - 6, nread);
+    size_t nread = fread(buffer + sizeof(header), 1, filesize - sizeof(header), stdin);
+    if (nread != filesize - sizeof(header)) {
+        fprintf(stderr, "Unable to read %zu remaining bytes, got %zu\n",
+                filesize - sizeof(header), nread);
         exit(EXIT_FAILURE);
     }
 
@@ -342,15 +319,17 @@ char *read_bmp_stdio(size_t *size) {
 // Based on libnsbmp decode_bmp example
 void *bmp_cb_create(int width, int height, unsigned int flags) {
     // BMP_NEW and BMP_OPAQUE flags unused
-    if (flags & BMP_CLEAR_MEMORY) {
-        return calloc(width * height, BMP_BYTES_PER_PIXEL);
-    } else {
-        return malloc(width * height * BMP_BYTES_PER_PIXEL);
+    size_t size = (size_t)width * height * BMP_BYTES_PER_PIXEL;
+    void *bitmap = cf_arena_alloc(arena, size);
+    if (bitmap && (flags & BMP_CLEAR_MEMORY)) {
+        memset(bitmap, 0, size);
     }
+    return bitmap;
 }
 
 void bmp_cb_destroy(void *bitmap) {
-    free(bitmap);
+    // freed with the arena
+    (void)bitmap;
 }
 
 unsigned char *bmp_cb_get_buffer(void *bitmap) {
@@ -358,8 +337,9 @@ unsigned char *bmp_cb_get_buffer(void *bitmap) {
 }
 // End BMP reading callback functions
 
-// Decode a BMP format image stored in filebuf
-int decode_bmp(bmp_image *image, bmp_bitmap_callback_vt *callbacks,
+// Analyse a BMP format image stored in filebuf
+// The image size is known once this returns; decode it with bmp_decode
+int analyse_bmp(bmp_image *image, bmp_bitmap_callback_vt *callbacks,
         void *filebuf, size_t size) {
     bmp_result result = bmp_create(image, callbacks);
     if (result != BMP_OK) {
@@ -371,65 +351,43 @@ int decode_bmp(bmp_image *image, bmp_bitmap_callback_vt *callbacks,
         return result;
     }
 
-    result = bmp_decode(image);
-    if (result != BMP_OK) {
-        return result;
-    }
-
     return BMP_OK;
 }
 
-// Will these two circles collide if one grows by incr?
-// Based on XScreenSaver boxfit by jwz
-bool circles_collide(circle *a, circle *b, int incr) {
-    // squared distance between circle centers
-    int centers = SQUARE(b->x - a->x) + SQUARE(b->y - a->y);
-    // squared sum of radii
-    int radii = SQUARE(a->r + b->r + incr);
-    return (centers < radii);
-}
-
-bool boxes_collide(box *a, box *b, int incr) {
-    return circles_collide(&a->cir, &b->cir, incr);
-}
-
-// Will this box be in bounds if it grows by incr?
-bool box_in_bounds(box *a, int incr) {
-    if (a->x - a->r - incr < 0 ||
-        a->y - a->r - incr < 0 ||
-        a->x + a->r + incr >= img_width ||
-        a->y + a->r + incr >= img_height
-    ) {
-        return false;
+// Parse a whole format name, ignoring case
+image_format_t parse_format(char *str) {
+    if (strcasecmp(str, "png") == 0) {
+        return PNG;
+    } else if (strcasecmp(str, "bmp") == 0) {
+        return BMP;
+    } else if (strcasecmp(str, "raw") == 0 || strcasecmp(str, "rgb") == 0 ||
+               strcasecmp(str, "rgb24") == 0) {
+        return RAW;
+    } else if (strcasecmp(str, "bgra") == 0) {
+        return BGRA;
+    } else if (strcasecmp(str, "xrgb") == 0 || strcasecmp(str, "xrgb8888") == 0) {
+        return XRGB;
     }
-    return true;
+    return UNKNOWN;
 }
 
-// Will this box be in bounds with no collisions if it grows by incr?
-bool box_legal(box *a, int incr) {
-    if (!box_in_bounds(a, incr)) {
-        return false;
-    }
-
-    for (int i = 0; i < nboxes; i++) {
-        box *b = &boxes[i];
-        if ((a != b) && boxes_collide(a, b, incr)) {
-            return false;
-        }
+// Guess a format from the whole extension of a filename
+image_format_t guess_format(char *filename) {
+    char *ext = strrchr(filename, '.');
+    if (!ext || strchr(ext, '/')) {
+        return UNKNOWN;
     }
-
-    return true;
+    return parse_format(ext + 1);
 }
 
-image_format_t parse_format(char *str) {
-    if (strncmp(str, "png", 3) == 0 || strncmp(str, "PNG", 3) == 0) {
-        return PNG;
-    } else if (strncmp(str, "bmp", 3) == 0 || strncmp(str, "BMP", 3) == 0) {
-        return BMP;
-    } else if (strncmp(str, "raw", 3) == 0 || strncmp(str, "RAW", 3) == 0) {
-        return RAW;
+// Bytes per pixel of a raw input format, 0 if not raw
+size_t raw_bytes_per_pixel(image_format_t format) {
+    if (format == RAW) {
+        return 3;
+    } else if (format == BGRA || format == XRGB) {
+        return 4;
     }
-    return UNKNOWN;
+    return 0;
 }
 
 void usage(void) {
@@ -449,39 +407,162 @@ Required arguments apply to both long and short options.\n\
                                 default 1, must be at least 1\n\
   -e, --edge-color=RRGGBB     hex color of the edge of circles; default 303030\n\
   -i, --input-file=STRING     input filename, stdin if not provided\n\
+  -d, --input-fd=INT          input file descriptor (e.g. a memfd), mapped\n\
+                                read-only instead of reading a file or stdin\n\
   -f, --input-format=STRING   input format, guessed from filename if possible;\n\
-                                'bmp' and 'png' supported, default 'bmp'\n\
+                                'bmp', 'png', 'raw'/'rgb24', 'bgra' and\n\
+                                'xrgb8888' supported, default 'bmp'\n\
+  -s, --size=WxH              input image size, required for and only valid\n\
+                                with raw formats\n\
   -o, --output-file=STRING    output filename, stdout if not provided\n\
   -F, --output-format=STRING  output format, guessed from filename if possible;\n\
                                 'raw' and 'png' supported, default 'raw'.\n\
-                                'raw' format is 24bpp RGB\n");
+                                'raw' format is 24bpp RGB\n\
+  -A, --animate               write one raw frame per growth tick instead of\n\
+                                only the final image; padding must be at\n\
+                                least 1, as touching circles would be drawn\n\
+                                out of order\n\
+  -D, --damage-file=STRING    with animate, write the rectangles changed in\n\
+                                each frame as 'frame x y width height' lines\n");
+}
+
+// Place circles on the placement thread, only needs the image size
+void *place_boxes(void *arg) {
+    (void)arg;
+    placement_result = cf_layout(ctx, img_width, img_height);
+    return NULL;
+}
+
+// Start circle placement on a worker thread once the image size is known,
+// so it runs while the image is still being read and decoded
+void start_placement(int width, int height) {
+    img_width = width;
+    img_height = height;
+    placement_started = true;
+    if (animate) {
+        return;
+    }
+
+    int rc = pthread_create(&placement_thread, NULL, place_boxes, NULL);
+    if (rc) {
+        fprintf(stderr, "Failed to start placement thread: %s\n", strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Start placement if the image header did not already give the size,
+// otherwise check that the decoded size matches
+void check_placement(int width, int height) {
+    if (!placement_started) {
+        start_placement(width, height);
+    } else if (width != img_width || height != img_height) {
+        fprintf(stderr, "Decoded image size %dx%d does not match header %dx%d\n",
+                width, height, img_width, img_height);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Exit with a message if a library call failed
+void check_result(cf_result result, char *what) {
+    if (result != CF_OK) {
+        fprintf(stderr, "Failed to %s: %s\n", what, cf_strerror(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Describe the decoded input image for coloring
+cf_image input_image(void) {
+    cf_image image = {0};
+    image.width = img_width;
+    image.height = img_height;
+
+    if (input_format == PNG) {
+        image.pixels = orig_png_buf;
+        // bytes per memory row = components per row * bytes per component
+        image.stride = PNG_IMAGE_ROW_STRIDE(orig_png) *
+            PNG_IMAGE_PIXEL_COMPONENT_SIZE(orig_png.format);
+        image.format = CF_PIXEL_RGB24;
+    } else if (input_format == BMP) {
+        image.pixels = orig_bmp.bitmap;
+        // bytes per memory row = image width * bytes per pixel
+        image.stride = orig_bmp.width * BMP_BYTES_PER_PIXEL;
+        image.format = CF_PIXEL_RGBA32;
+    } else {
+        image.pixels = orig_raw;
+        image.stride = orig_raw_stride;
+        if (input_format == BGRA) {
+            image.format = CF_PIXEL_BGRA32;
+        } else if (input_format == XRGB) {
+            image.format = CF_PIXEL_XRGB8888;
+        } else {
+            image.format = CF_PIXEL_RGB24;
+        }
+    }
+
+    return image;
+}
+
+// Write one raw frame per growth tick to output_fp, each drawn incrementally
+// over the previous one, and the changed rectangles of each frame to damage_fp
+// if given, as lines of "frame x y width height"
+void write_animation(FILE *damage_fp) {
+    cf_image image = input_image();
+    check_result(cf_layout_begin(ctx, img_width, img_height), "place circles");
+
+    int finished = false;
+    for (int frame = 0; !finished; frame++) {
+        check_result(cf_layout_step(ctx, &finished), "place circles");
+        check_result(cf_colorize(ctx, &image), "color circles");
+
+        const cf_rect *damage;
+        int ndamage;
+        check_result(cf_render_tick(ctx, outbuf, img_width * sizeof(pixel),
+                    &damage, &ndamage), "render frame");
+
+        size_t count = (size_t)img_width * img_height;
+        size_t nwritten = fwrite(outbuf, sizeof(pixel), count, output_fp);
+        if (nwritten != count) {
+            fprintf(stderr, "Unable to write %zu pixels, wrote %zu\n",
+                    count, nwritten);
+            exit(EXIT_FAILURE);
+        }
+
+        if (damage_fp) {
+            for (int i = 0; i < ndamage; i++) {
+                fprintf(damage_fp, "%d %d %d %d %d\n", frame, damage[i].x,
+                        damage[i].y, damage[i].width, damage[i].height);
+            }
+        }
+    }
 }
 
 int main(int argc, char *argv[]) {
 
-    int max_alive = 100;   // max number of live boxes at a time
-    int max_total = 65535; // max total number of boxes
-    int min_radius = 5;    // minimum radius of a circle
-    int padding = 2;       // padding between boxes and on edges
-    int grow_by = 1;       // amount to increase radius each iteration
+    cf_params params;
+    cf_default_params(&params);
+    params.seed = time(NULL);
 
     char edge_color_str[8] = {0};
-    color edge_color = {0x30, 0x30, 0x30}; // border color of boxes
 
     char input_filename[256] = {0};
     char output_filename[256] = {0};
+    char damage_filename[256] = {0};
     bool use_input_filename = false;
     bool use_output_filename = false;
+    bool use_damage_filename = false;
 
-    char input_format_str[8] = {0};
-    char output_format_str[8] = {0};
+    int input_fd = -1;
+    char size_str[32] = {0};
+
+    char input_format_str[16] = {0};
+    char output_format_str[16] = {0};
     input_format = BMP;
     image_format_t output_format = RAW;
 
     // get command-line options
     int rc;
     int option_index = 0;
-    char *options = "ha:t:r:p:g:e:i:f:o:F:";
+    char *options = "ha:t:r:p:g:e:i:d:f:s:o:F:AD:";
     struct option long_options[] = {
         {"help",          no_argument,       0, 'h'},
         {"max-alive",     required_argument, 0, 'a'},
@@ -491,9 +572,13 @@ int main(int argc, char *argv[]) {
         {"grow-by",       required_argument, 0, 'g'},
         {"edge-color",    required_argument, 0, 'e'},
         {"input-file",    required_argument, 0, 'i'},
+        {"input-fd",      required_argument, 0, 'd'},
         {"input-format",  required_argument, 0, 'f'},
+        {"size",          required_argument, 0, 's'},
         {"output-file",   required_argument, 0, 'o'},
         {"output-format", required_argument, 0, 'F'},
+        {"animate",       no_argument,       0, 'A'},
+        {"damage-file",   required_argument, 0, 'D'},
         {0,               0,                 0, 0}
     };
     opterr = 1; // have getopt show error messages for us
@@ -505,19 +590,19 @@ int main(int argc, char *argv[]) {
                 usage();
                 exit(EXIT_SUCCESS);
             case 'a':
-                max_alive = strtol(optarg, NULL, 10);
+                params.max_alive = strtol(optarg, NULL, 10);
                 break;
             case 't':
-                max_total = strtol(optarg, NULL, 10);
+                params.max_total = strtol(optarg, NULL, 10);
                 break;
             case 'r':
-                min_radius = strtol(optarg, NULL, 10);
+                params.min_radius = strtol(optarg, NULL, 10);
                 break;
             case 'p':
-                padding = strtol(optarg, NULL, 10);
+                params.padding = strtol(optarg, NULL, 10);
                 break;
             case 'g':
-                grow_by = strtol(optarg, NULL, 10);
+                params.grow_by = strtol(optarg, NULL, 10);
                 break;
             case 'e':
                 strncpy(edge_color_str, optarg, 7);
@@ -526,15 +611,36 @@ int main(int argc, char *argv[]) {
                 strncpy(input_filename, optarg, 255);
                 use_input_filename = true;
                 break;
+            case 'd': {
+                char *end;
+                errno = 0;
+                long fd = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || fd < 0 || fd > INT_MAX) {
+                    fprintf(stderr, "circlefit: input-fd must be a file descriptor number\n");
+                    exit(EXIT_FAILURE);
+                }
+                input_fd = fd;
+                break;
+            }
             case 'f':
-                strncpy(input_format_str, optarg, 7);
+                strncpy(input_format_str, optarg, 15);
+                break;
+            case 's':
+                strncpy(size_str, optarg, 31);
                 break;
             case 'o':
                 strncpy(output_filename, optarg, 255);
                 use_output_filename = true;
                 break;
             case 'F':
-                strncpy(output_format_str, optarg, 7);
+                strncpy(output_format_str, optarg, 15);
+                break;
+            case 'A':
+                animate = true;
+                break;
+            case 'D':
+                strncpy(damage_filename, optarg, 255);
+                use_damage_filename = true;
                 break;
             case '?':
                 // error message handled by getopt
@@ -554,26 +660,42 @@ int main(int argc, char *argv[]) {
     }
 
     // check numeric option bounds
-    if (max_alive < 1) {
+    if (params.max_alive < 1) {
         fprintf(stderr, "circlefit: max-alive must be at least 1\n");
         exit(EXIT_FAILURE);
     }
-    if (max_total < 0) {
+    if (params.max_total < 0) {
         fprintf(stderr, "circlefit: max-total must be at least 0\n");
         exit(EXIT_FAILURE);
     }
-    if (min_radius < 1) {
+    if (params.min_radius < 1) {
         fprintf(stderr, "circlefit: min-radius must be at least 1\n");
         exit(EXIT_FAILURE);
     }
-    if (padding < 0) {
+    if (params.padding < 0) {
         fprintf(stderr, "circlefit: padding must be at least 0\n");
         exit(EXIT_FAILURE);
     }
-    if (grow_by < 1) {
+    if (params.grow_by < 1) {
         fprintf(stderr, "circlefit: grow-by must be at least 1\n");
         exit(EXIT_FAILURE);
     }
+    if (use_input_filename && input_fd >= 0) {
+        fprintf(stderr, "circlefit: input-file and input-fd are exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // interpret size string
+    int size_width = 0;
+    int size_height = 0;
+    if (strlen(size_str) > 0) {
+        char trailing;
+        if (sscanf(size_str, "%dx%d%c", &size_width, &size_height, &trailing) != 2 ||
+                size_width < 1 || size_height < 1) {
+            fprintf(stderr, "circlefit: size must be in WxH format\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // interpret edge color hex string
     if (strlen(edge_color_str) > 0) {
@@ -581,20 +703,20 @@ int main(int argc, char *argv[]) {
 
         hex[0] = edge_color_str[0];
         hex[1] = edge_color_str[1];
-        edge_color.r = (uint8_t) strtoul(hex, NULL, 16);
+        params.edge_color.r = (uint8_t) strtoul(hex, NULL, 16);
 
         hex[0] = edge_color_str[2];
         hex[1] = edge_color_str[3];
-        edge_color.g = (uint8_t) strtoul(hex, NULL, 16);
+        params.edge_color.g = (uint8_t) strtoul(hex, NULL, 16);
 
         hex[0] = edge_color_str[4];
         hex[1] = edge_color_str[5];
-        edge_color.b = (uint8_t) strtoul(hex, NULL, 16);
+        params.edge_color.b = (uint8_t) strtoul(hex, NULL, 16);
 
         if (
-                (edge_color.r == 0x00 && !(edge_color_str[0] == '0' && edge_color_str[1] == '0')) ||
-                (edge_color.g == 0x00 && !(edge_color_str[2] == '0' && edge_color_str[3] == '0')) ||
-                (edge_color.b == 0x00 && !(edge_color_str[4] == '0' && edge_color_str[5] == '0'))
+                (params.edge_color.r == 0x00 && !(edge_color_str[0] == '0' && edge_color_str[1] == '0')) ||
+                (params.edge_color.g == 0x00 && !(edge_color_str[2] == '0' && edge_color_str[3] == '0')) ||
+                (params.edge_color.b == 0x00 && !(edge_color_str[4] == '0' && edge_color_str[5] == '0'))
            ) {
             fprintf(stderr, "circlefit: edge-color must be in RRGGBB hex format\n");
             exit(EXIT_FAILURE);
@@ -604,19 +726,26 @@ int main(int argc, char *argv[]) {
     // determine input format
     if (strlen(input_format_str) > 0) {
         input_format = parse_format(input_format_str);
-        if (!(input_format == BMP || input_format == PNG)) {
-            fprintf(stderr, "circlefit: input-format must be 'bmp' or 'png'\n");
+        if (input_format == UNKNOWN) {
+            fprintf(stderr, "circlefit: input-format must be 'bmp', 'png', "
+                    "'raw', 'bgra' or 'xrgb8888'\n");
             exit(EXIT_FAILURE);
         }
     } else if (use_input_filename) {
-        size_t input_len = strlen(input_filename);
-        if (input_len >= 3) {
-            image_format_t guessed_format = parse_format(input_filename + input_len - 3);
-            if (guessed_format == PNG || guessed_format == BMP) {
-                input_format = guessed_format;
-            }
+        image_format_t guessed_format = guess_format(input_filename);
+        if (guessed_format != UNKNOWN) {
+            input_format = guessed_format;
         }
     }
+    size_t raw_bpp = raw_bytes_per_pixel(input_format);
+    if (raw_bpp && !(size_width && size_height)) {
+        fprintf(stderr, "circlefit: size is required for raw input formats\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!raw_bpp && size_width) {
+        fprintf(stderr, "circlefit: size is only used for raw input formats\n");
+        exit(EXIT_FAILURE);
+    }
 
     // determine output format
     if (strlen(output_format_str) > 0) {
@@ -626,157 +755,184 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
     } else if (use_output_filename) {
-        size_t output_len = strlen(output_filename);
-        if (output_len >= 3) {
-            image_format_t guessed_format = parse_format(output_filename + output_len - 3);
-            if (guessed_format == RAW || guessed_format == PNG) {
-                output_format = guessed_format;
-            }
+        image_format_t guessed_format = guess_format(output_filename);
+        if (guessed_format == RAW || guessed_format == PNG) {
+            output_format = guessed_format;
         }
     }
 
+    if (animate && output_format != RAW) {
+        fprintf(stderr, "circlefit: animation output must be 'raw'\n");
+        exit(EXIT_FAILURE);
+    }
+    if (animate && params.padding < 1) {
+        // frames are drawn incrementally, so circles touching with no padding
+        // would overwrite each other's shared edge pixels out of order
+        fprintf(stderr, "circlefit: animate requires padding of at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+    if (use_damage_filename && !animate) {
+        fprintf(stderr, "circlefit: damage-file requires animate\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the context allocates boxes and spans from the arena as well
+    check_result(cf_arena_create(&arena), "create arena");
+    cf_allocator allocator;
+    cf_arena_allocator(arena, &allocator);
+    check_result(cf_create(&ctx, &params, &allocator), "create context");
+
+    // map input fd, or input file for formats read from memory
+    if (input_fd >= 0) {
+        input_map = map_fd(input_fd, &input_map_size);
+    } else if ((raw_bpp || input_format == BMP) && use_input_filename) {
+        input_map = map_file(input_filename, &input_map_size);
+    }
+
     // read input image
+    // placement starts as soon as the image size is known, and runs on its
+    // own thread while the rest of the image is read and decoded
     size_t bmp_size;
-    char *bmp_file;
+    char *bmp_file = NULL;
+    char *raw_file = NULL;
     if (input_format == PNG) {
-        if (use_input_filename) {
-            read_png_file(&orig_png, &orig_png_buf, input_filename);
+        if (input_map) {
+            begin_read_png_memory(&orig_png, input_map, input_map_size);
+        } else if (use_input_filename) {
+            begin_read_png_file(&orig_png, input_filename);
         } else {
-            read_png_stdio(&orig_png, &orig_png_buf);
+            begin_read_png_stdio(&orig_png);
         }
-        img_width = orig_png.width;
-        img_height = orig_png.height;
+        start_placement(orig_png.width, orig_png.height);
+        finish_read_png(&orig_png, &orig_png_buf);
     } else if (input_format == BMP) {
-        if (use_input_filename) {
-            bmp_file = read_file(input_filename, &bmp_size);
+        if (input_map) {
+            // the header is already mapped, so place while the pixels are
+            // paged in and decoded
+            bmp_size = input_map_size;
+            int width, height;
+            if (bmp_header_size(input_map, input_map_size, &width, &height)) {
+                start_placement(width, height);
+            }
         } else {
-            bmp_file = read_bmp_stdio(&bmp_size);
+            bmp_file = read_bmp_stdio(&bmp_size, start_placement);
         }
-        if (decode_bmp(&orig_bmp, &bmp_callbacks, bmp_file, bmp_size) != BMP_OK) {
+        if (analyse_bmp(&orig_bmp, &bmp_callbacks,
+                    input_map ? input_map : bmp_file, bmp_size) != BMP_OK) {
             fprintf(stderr, "Failed to decode BMP image\n");
             exit(EXIT_FAILURE);
         }
-        img_width = orig_bmp.width;
-        img_height = orig_bmp.height;
-    } else {
-        fprintf(stderr, "Unsupported input format\n");
-        exit(EXIT_FAILURE);
-    }
-
-    srand(time(NULL));
-
-    // Circle generation algorithm
-    // Based on XScreenSaver boxfit by jwz
-
-    // allocate initial boxes storage
-    int boxes_size = 2 * max_alive;
-    boxes = calloc(boxes_size, sizeof(*boxes));
-    if (!boxes) {
-        fprintf(stderr, "Failed to allocate memory for %d boxes\n", boxes_size);
-        exit(EXIT_FAILURE);
-    }
-
-    // start circle placement
-    nboxes = 0; // total number of existing boxes
-    int nalive = 0; // number of living boxes
-    bool finished = false;
-
-    while (!finished) {
-        // grow boxes if possible
-        for (int i = 0; i < nboxes; i++) {
-            box *b = &boxes[i];
-
-            if (!b->alive) {
-                // don't keep growing, it's already dead
-            } else if (!box_legal(b, grow_by + padding)) {
-                // can't grow anymore, make it dead
-                b->alive = false;
-                nalive--;
-            } else {
-                // grow the box
-                b->r += grow_by;
-            }
+        check_placement(orig_bmp.width, orig_bmp.height);
+        if (bmp_decode(&orig_bmp) != BMP_OK) {
+            fprintf(stderr, "Failed to decode BMP image\n");
+            exit(EXIT_FAILURE);
         }
-
-        // add new boxes if needed
-        while (nalive < max_alive) {
-            if (boxes_size <= nboxes) {
-                // need to reallocate
-                boxes_size = (1.5 * boxes_size) + nboxes;
-                boxes = realloc(boxes, boxes_size * sizeof(*boxes));
-                if (!boxes) {
-                    fprintf(stderr, "Failed to allocate memory for %d boxes\n",
-                            boxes_size);
-                    exit(EXIT_FAILURE);
-                }
-            }
-
-            // try to add a new box 100 times
-            box *b = &boxes[nboxes];
-            b->alive = false;
-            for (int i = 0; i < 100; i++) {
-                b->x = padding + (rand() % (img_width - 2*padding));
-                b->y = padding + (rand() % (img_height - 2*padding));
-                b->r = min_radius;
-
-                if (box_legal(b, padding)) {
-                    // successfully found a spot
-                    b->alive = true;
-                    nboxes++;
-                    nalive++;
-                    break;
-                }
-            }
-            if (!b->alive || nboxes >= max_total) {
-                // unable to find a new box to add, or reached max
-                finished = true;
-                break;
+    } else if (raw_bpp) {
+        size_t raw_size = raw_bpp * size_width * size_height;
+        start_placement(size_width, size_height);
+        if (input_map) {
+            if (input_map_size < raw_size) {
+                fprintf(stderr, "Raw input has %zu bytes, expected %zu\n",
+                        input_map_size, raw_size);
+                exit(EXIT_FAILURE);
             }
+            orig_raw = input_map;
+        } else {
+            raw_file = read_stdio(raw_size);
+            orig_raw = (uint8_t *)raw_file;
         }
+        orig_raw_stride = raw_bpp * size_width;
+    } else {
+        fprintf(stderr, "Unsupported input format\n");
+        exit(EXIT_FAILURE);
     }
 
-    outbuf = calloc(img_width * img_height, sizeof(pixel));
+    // cf_render clears each band, so no need to zero the buffer here
+    outbuf = cf_arena_alloc(arena, img_width * img_height * sizeof(pixel));
     if (!outbuf) {
         fprintf(stderr, "Failed to allocate %zu bytes\n",
                 img_width * img_height * sizeof(pixel));
         exit(EXIT_FAILURE);
     }
 
-    // draw boxes
-    for (int i = 0; i < nboxes; i++) {
-        box *b = &boxes[i];
-        draw_box(b, getpixel(b->x, b->y), edge_color);
-    }
-
-    // write output image
-    if (output_format == RAW) {
-        if (use_output_filename) {
-            write_file(outbuf, sizeof(pixel) * img_width * img_height, output_filename);
-        } else {
-            fwrite(outbuf, sizeof(pixel), img_width * img_height, stdout);
+    if (animate) {
+        output_fp = use_output_filename ? open_output(output_filename) : stdout;
+        FILE *damage_fp = use_damage_filename ? open_output(damage_filename) : NULL;
+        write_animation(damage_fp);
+        if (damage_fp) {
+            fclose(damage_fp);
         }
-    } else if (output_format == PNG) {
         if (use_output_filename) {
-            write_png_file(&outbuf, img_width, img_height, output_filename);
+            fclose(output_fp);
         } else {
-            write_png_stdio(&outbuf, img_width, img_height);
+            fflush(stdout);
         }
     } else {
-        fprintf(stderr, "Unsupported output format\n");
-        exit(EXIT_FAILURE);
+        // wait for placement to finish
+        int rc_join = pthread_join(placement_thread, NULL);
+        if (rc_join) {
+            fprintf(stderr, "Failed to join placement thread: %s\n", strerror(rc_join));
+            exit(EXIT_FAILURE);
+        }
+        check_result(placement_result, "place circles");
+
+        cf_image image = input_image();
+        check_result(cf_colorize(ctx, &image), "color circles");
+
+        // raw output is written band by band while later bands are drawn
+        pthread_t writer_thread;
+        if (output_format == RAW) {
+            output_fp = use_output_filename ? open_output(output_filename) : stdout;
+            int rc_writer = pthread_create(&writer_thread, NULL, write_raw_bands, NULL);
+            if (rc_writer) {
+                fprintf(stderr, "Failed to start writer thread: %s\n", strerror(rc_writer));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // draw boxes
+        for (int y = 0; y < img_height; y += BAND_ROWS) {
+            check_result(cf_render(ctx, outbuf, img_width * sizeof(pixel),
+                        y, MIN(y + BAND_ROWS, img_height)), "render circles");
+
+            pthread_mutex_lock(&bands_lock);
+            bands_rendered++;
+            pthread_cond_signal(&bands_cond);
+            pthread_mutex_unlock(&bands_lock);
+        }
+
+        // write output image
+        if (output_format == RAW) {
+            pthread_join(writer_thread, NULL);
+            if (use_output_filename) {
+                fclose(output_fp);
+            } else {
+                fflush(stdout);
+            }
+        } else if (output_format == PNG) {
+            if (use_output_filename) {
+                write_png_file(&outbuf, img_width, img_height, output_filename);
+            } else {
+                write_png_stdio(&outbuf, img_width, img_height);
+            }
+        } else {
+            fprintf(stderr, "Unsupported output format\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
     // clean up
     if (input_format == PNG) {
         png_image_free(&orig_png);
-        free(orig_png_buf);
     } else if (input_format == BMP) {
         bmp_finalise(&orig_bmp);
-        free(bmp_file);
+    }
+    if (input_map) {
+        munmap(input_map, input_map_size);
     }
 
-    free(boxes);
-    free(outbuf);
+    cf_destroy(ctx);
+    cf_arena_destroy(arena);
 
     return 0;
 }
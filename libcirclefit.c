@@ -0,0 +1,952 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "libcirclefit.h"
+
+#define SQUARE(x) ((x) * (x))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// boxes checked at a time for collisions, without an early exit in between
+#define COLLIDE_BLOCK 64
+
+// arena allocations of at least a huge page get regions of whole huge pages,
+// smaller ones share regular-page regions; all are cache line aligned
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define SMALL_REGION_SIZE ((size_t)64 << 10)
+#define ARENA_ALIGN 64
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+// Hot kernels are compiled once per CPU level, and the best version for the
+// running CPU is picked once at load time
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define HOT_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef HOT_KERNEL
+#define HOT_KERNEL
+#endif
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+typedef cf_color color;
+typedef color pixel;
+
+typedef struct circle_t {
+    int x;
+    int y;
+    int r;
+} circle;
+
+typedef struct {
+    union {
+        struct circle_t; // MS extension
+        circle cir;
+    };
+    bool alive;
+    color fill;
+    int drawn_r; // radius last drawn by cf_render_tick, 0 if not drawn yet
+} box;
+
+struct cf_context {
+    cf_params params;
+    cf_allocator allocator;
+    unsigned int rand_state;
+
+    // canvas size given to cf_layout, 0 before the first layout
+    int width;
+    int height;
+
+    int nboxes;
+    int boxes_size;
+    box *boxes;
+    int ncolored; // boxes colored so far, always the first ones
+
+    // placement progress between cf_layout_step calls
+    int nalive;
+    bool finished;
+
+    // animation frames rendered since cf_layout_begin
+    int ticks;
+
+    // per-row half widths of a circle fill followed by those of an inner
+    // edge, spans_size each, for cf_render_tick
+    int spans_size;
+    int *spans;
+
+    // damage rectangles of the last cf_render_tick
+    int damage_size;
+    cf_rect *damage;
+};
+
+// One mapping of an arena, allocated from by bumping used
+typedef struct arena_region {
+    struct arena_region *next;
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t last; // offset of the last allocation, for growing it in place
+} arena_region;
+
+struct cf_arena {
+    pthread_mutex_t lock;
+    arena_region *regions;
+};
+
+// Output rows [ymin, ymax) of a caller's 24bpp buffer
+typedef struct {
+    uint8_t *buf;
+    size_t stride;
+    int ymin;
+    int ymax;
+} canvas;
+
+// Sampler for one source pixel format
+typedef color (*sampler)(const cf_image *image, int x, int y);
+
+// Default allocator callbacks
+static void *default_alloc(size_t size, void *user) {
+    (void)user;
+    return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t old_size, size_t new_size,
+        void *user) {
+    (void)old_size;
+    (void)user;
+    return realloc(ptr, new_size);
+}
+
+static void default_free(void *ptr, size_t size, void *user) {
+    (void)size;
+    (void)user;
+    free(ptr);
+}
+
+static const cf_allocator default_allocator = {
+    default_alloc,
+    default_realloc,
+    default_free,
+    NULL
+};
+// End default allocator callbacks
+
+// Map size bytes aligned to a huge page, backed by explicit huge pages if the
+// system has them reserved, otherwise by transparent huge pages if enabled
+static void *map_huge(size_t size) {
+#ifdef MAP_HUGETLB
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+        return map;
+    }
+#endif
+
+    // over-map by one huge page, then trim to an aligned range
+    size_t padded = size + HUGE_PAGE_SIZE;
+    uint8_t *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t *aligned = (uint8_t *)ALIGN_UP((uintptr_t)raw, HUGE_PAGE_SIZE);
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size < raw + padded) {
+        munmap(aligned + size, raw + padded - (aligned + size));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+// Arena allocator callbacks
+static void *arena_alloc(size_t size, void *user) {
+    return cf_arena_alloc(user, size);
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size,
+        void *user) {
+    cf_arena *arena = user;
+    if (!ptr) {
+        return cf_arena_alloc(arena, new_size);
+    }
+
+    // grow in place if ptr is the last allocation of its region
+    pthread_mutex_lock(&arena->lock);
+    for (arena_region *r = arena->regions; r; r = r->next) {
+        if ((uint8_t *)ptr == r->base + r->last &&
+                r->last + ALIGN_UP(new_size, ARENA_ALIGN) <= r->size) {
+            r->used = r->last + ALIGN_UP(new_size, ARENA_ALIGN);
+            pthread_mutex_unlock(&arena->lock);
+            return ptr;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    void *grown = cf_arena_alloc(arena, new_size);
+    if (grown) {
+        memcpy(grown, ptr, MIN(old_size, new_size));
+    }
+    return grown;
+}
+
+static void arena_free(void *ptr, size_t size, void *user) {
+    // everything is freed at once by cf_arena_reset or cf_arena_destroy
+    (void)ptr;
+    (void)size;
+    (void)user;
+}
+// End arena allocator callbacks
+
+// Source samplers, one per pixel format
+static color sample_rgb24(const cf_image *image, int x, int y) {
+    const uint8_t *p = (const uint8_t *)image->pixels + y*image->stride + 3*x;
+    return (color){p[0], p[1], p[2]};
+}
+
+static color sample_rgba32(const cf_image *image, int x, int y) {
+    const uint8_t *p = (const uint8_t *)image->pixels + y*image->stride + 4*x;
+    return (color){p[0], p[1], p[2]};
+}
+
+static color sample_bgra32(const cf_image *image, int x, int y) {
+    const uint8_t *p = (const uint8_t *)image->pixels + y*image->stride + 4*x;
+    return (color){p[2], p[1], p[0]};
+}
+
+static color sample_xrgb8888(const cf_image *image, int x, int y) {
+    uint32_t w = *(const uint32_t *)((const uint8_t *)image->pixels +
+            y*image->stride + 4*x);
+    return (color){(w >> 16) & 0xFF, (w >> 8) & 0xFF, w & 0xFF};
+}
+
+// Sampler for a pixel format, NULL if unknown
+static sampler select_sampler(cf_pixel_format format) {
+    switch (format) {
+        case CF_PIXEL_RGB24:
+            return sample_rgb24;
+        case CF_PIXEL_RGBA32:
+            return sample_rgba32;
+        case CF_PIXEL_BGRA32:
+            return sample_bgra32;
+        case CF_PIXEL_XRGB8888:
+            return sample_xrgb8888;
+    }
+    return NULL;
+}
+
+// Bytes per pixel of a source format, 0 if unknown
+static size_t pixel_size(cf_pixel_format format) {
+    switch (format) {
+        case CF_PIXEL_RGB24:
+            return 3;
+        case CF_PIXEL_RGBA32:
+        case CF_PIXEL_BGRA32:
+        case CF_PIXEL_XRGB8888:
+            return 4;
+    }
+    return 0;
+}
+
+static void putpixel(const canvas *cv, int x, int y, color c) {
+    pixel *row = (pixel *)(cv->buf + y*cv->stride);
+    row[x] = c;
+}
+
+// Is row y inside the canvas rows [ymin, ymax)?
+static bool in_band(const canvas *cv, int y) {
+    return y >= cv->ymin && y < cv->ymax;
+}
+
+static void xline(const canvas *cv, int xa, int xb, int y, color c) {
+    if (xa > xb)
+        return;
+    for (int i = xa; i <= xb; i++) {
+        putpixel(cv, i, y, c);
+    }
+}
+
+// draw points in all 8 symmetric octants of a circle, within the canvas rows
+static void draw_circle_octant_points(const canvas *cv, int cx, int cy,
+        int x, int y, color c) {
+    // quadrants of circle
+    if (in_band(cv, cy + y)) {
+        putpixel(cv, cx + x, cy + y, c);
+        putpixel(cv, cx - x, cy + y, c);
+    }
+    if (in_band(cv, cy - y)) {
+        putpixel(cv, cx + x, cy - y, c);
+        putpixel(cv, cx - x, cy - y, c);
+    }
+    if (x != y) {
+        // also do octants by swapping x and y
+        if (in_band(cv, cy + x)) {
+            putpixel(cv, cx + y, cy + x, c);
+            putpixel(cv, cx - y, cy + x, c);
+        }
+        if (in_band(cv, cy - x)) {
+            putpixel(cv, cx + y, cy - x, c);
+            putpixel(cv, cx - y, cy - x, c);
+        }
+    }
+}
+
+// fill a circle using octants, within the canvas rows
+static void fill_circle_octant_points(const canvas *cv, int cx, int cy,
+        int x, int y, color c) {
+    // quadrants of circle
+    if (in_band(cv, cy + y))
+        xline(cv, cx - x, cx + x, cy + y, c);
+    if (in_band(cv, cy - y))
+        xline(cv, cx - x, cx + x, cy - y, c);
+    if (x != y) {
+        // also do octants by swapping x and y
+        if (in_band(cv, cy + x))
+            xline(cv, cx - y, cx + y, cy + x, c);
+        if (in_band(cv, cy - x))
+            xline(cv, cx - y, cx + y, cy - x, c);
+    }
+
+}
+
+// Bresenham Circle Drawing Algorithm
+// https://funloop.org/post/2021-03-15-bresenham-circle-drawing-algorithm.html
+// Only the canvas rows are drawn, so the image can be rendered in bands.
+// Always inlined with a constant fill into draw_circle_fill/draw_circle_outline.
+// CAUTION: No bounds checking
+ALWAYS_INLINE
+void draw_circle(const canvas *cv, bool fill, circle cir, color col) {
+    // Calculation coordinates are based on (0, 0) at center, math polarity.
+    // Start in standard position.
+    int x = cir.r;
+    int y = 0;
+
+    // F = distance from true circle
+    int F = 1 - cir.r; // approx for (r - 0.5, 1)
+    // dN and dNW = how much F will change when going the respective direction
+    int dN = 3;
+    int dNW = 5 - (2 * cir.r);
+
+    // first point
+    if (fill)
+        fill_circle_octant_points(cv, cir.x, cir.y, x, y, col);
+    else
+        draw_circle_octant_points(cv, cir.x, cir.y, x, y, col);
+
+    while (x > y) {
+        if (F <= 0) {
+            // Northwest would go too far inside the circle, go north instead.
+            // X remains the same.
+            // Update F: increases by dN
+            F += dN;
+            // Update dN and dNW
+            dN += 2;
+            dNW += 2;
+        } else {
+            // Go northwest by default.
+            x--;
+            // Update F: increases by dNW
+            F += dNW;
+            // Update dN and dNW
+            dN += 2;
+            dNW += 4;
+        }
+        y++;
+        if (fill)
+            fill_circle_octant_points(cv, cir.x, cir.y, x, y, col);
+        else
+            draw_circle_octant_points(cv, cir.x, cir.y, x, y, col);
+    }
+}
+
+// Filled circle, with no fill branch left in the loop
+HOT_KERNEL
+static void draw_circle_fill(const canvas *cv, circle cir, color col) {
+    draw_circle(cv, true, cir, col);
+}
+
+// Circle outline, with no fill branch left in the loop
+HOT_KERNEL
+static void draw_circle_outline(const canvas *cv, circle cir, color col) {
+    draw_circle(cv, false, cir, col);
+}
+
+// Draw the canvas rows of a box with its fill color and an edge color
+static void draw_box(const canvas *cv, const box *b, color edge) {
+    draw_circle_fill(cv, b->cir, b->fill);
+    draw_circle_outline(cv, b->cir, edge);
+}
+
+// Make room in spans for circles up to radius r
+static bool reserve_spans(cf_context *ctx, int r) {
+    const cf_allocator *allocator = &ctx->allocator;
+    if (ctx->spans_size > r) {
+        return true;
+    }
+
+    // old contents are not needed, so allocate afresh rather than realloc
+    int size = MAX(r + 1, 2 * ctx->spans_size);
+    int *spans = allocator->alloc(2 * size * sizeof(int), allocator->user);
+    if (!spans) {
+        return false;
+    }
+    if (ctx->spans) {
+        allocator->free(ctx->spans, 2 * ctx->spans_size * sizeof(int),
+                allocator->user);
+    }
+    ctx->spans = spans;
+    ctx->spans_size = size;
+    return true;
+}
+
+// Per-row half widths of a Bresenham circle of radius r, for rows 0 to r
+// below the center. fill gets the half width drawn by draw_circle_fill and
+// edge the innermost point drawn by draw_circle_outline; either may be NULL.
+static void circle_spans(int r, int *fill, int *edge) {
+    for (int i = 0; i <= r; i++) {
+        if (fill)
+            fill[i] = -1;
+        if (edge)
+            edge[i] = r + 1;
+    }
+
+    // same steps as draw_circle
+    int x = r;
+    int y = 0;
+    int F = 1 - r;
+    int dN = 3;
+    int dNW = 5 - (2 * r);
+    while (true) {
+        if (fill) {
+            fill[y] = MAX(fill[y], x);
+            if (x != y)
+                fill[x] = MAX(fill[x], y);
+        }
+        if (edge) {
+            edge[y] = MIN(edge[y], x);
+            if (x != y)
+                edge[x] = MIN(edge[x], y);
+        }
+        if (x <= y)
+            break;
+        if (F <= 0) {
+            F += dN;
+            dN += 2;
+            dNW += 2;
+        } else {
+            x--;
+            F += dNW;
+            dN += 2;
+            dNW += 4;
+        }
+        y++;
+    }
+}
+
+// Grow a drawn box from drawn_r to its current radius, painting only the ring
+// between the old edge and the new circle before drawing the new edge. This
+// gives the same pixels as drawing the box afresh.
+static void draw_box_ring(const cf_context *ctx, const canvas *cv,
+        const box *b, color edge) {
+    int *fill = ctx->spans;
+    int *inner = ctx->spans + ctx->spans_size;
+    circle_spans(b->r, fill, NULL);
+    circle_spans(b->drawn_r, NULL, inner);
+
+    for (int dy = 0; dy <= b->r; dy++) {
+        // rows below and above the center, once for the center row
+        for (int row = b->y + dy; ; row = b->y - dy) {
+            if (dy <= b->drawn_r) {
+                xline(cv, b->x - fill[dy], b->x - inner[dy], row, b->fill);
+                xline(cv, b->x + inner[dy], b->x + fill[dy], row, b->fill);
+            } else {
+                xline(cv, b->x - fill[dy], b->x + fill[dy], row, b->fill);
+            }
+            if (dy == 0 || row == b->y - dy)
+                break;
+        }
+    }
+    draw_circle_outline(cv, b->cir, edge);
+}
+
+// Will these two circles collide if one grows by incr?
+// Based on XScreenSaver boxfit by jwz
+static bool circles_collide(const circle *a, const circle *b, int incr) {
+    // squared distance between circle centers
+    int centers = SQUARE(b->x - a->x) + SQUARE(b->y - a->y);
+    // squared sum of radii
+    int radii = SQUARE(a->r + b->r + incr);
+    return (centers < radii);
+}
+
+static bool boxes_collide(const box *a, const box *b, int incr) {
+    return circles_collide(&a->cir, &b->cir, incr);
+}
+
+// Will this box be in bounds if it grows by incr?
+static bool box_in_bounds(const cf_context *ctx, const box *a, int incr) {
+    if (a->x - a->r - incr < 0 ||
+        a->y - a->r - incr < 0 ||
+        a->x + a->r + incr >= ctx->width ||
+        a->y + a->r + incr >= ctx->height
+    ) {
+        return false;
+    }
+    return true;
+}
+
+// Will this box be in bounds with no collisions if it grows by incr?
+// Collisions are checked a block at a time with no early exit inside the block,
+// so the inner loop can be vectorized.
+HOT_KERNEL
+static bool box_legal(const cf_context *ctx, const box *a, int incr) {
+    if (!box_in_bounds(ctx, a, incr)) {
+        return false;
+    }
+
+    // index of a itself, compared instead of pointers to keep the loop vectorizable
+    int self = a - ctx->boxes;
+    for (int start = 0; start < ctx->nboxes; start += COLLIDE_BLOCK) {
+        int end = MIN(start + COLLIDE_BLOCK, ctx->nboxes);
+        int collisions = 0;
+        for (int i = start; i < end; i++) {
+            collisions += (i != self) & boxes_collide(a, &ctx->boxes[i], incr);
+        }
+        if (collisions) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Upper bound on the number of circles that fit on a width x height canvas
+// Circles are at least min_radius and padding apart, so circles grown by half
+// the padding do not overlap and stay on the canvas.
+static int estimate_circles(const cf_params *params, int width, int height) {
+    double r = params->min_radius + params->padding / 2.0;
+    double fit = (double)width * height / (M_PI * r * r);
+    // one spare slot, as placement fills in the next box before checking it
+    return (fit < params->max_total ? (int)fit : params->max_total) + 1;
+}
+
+// Are the placement parameters in range?
+static bool params_valid(const cf_params *params) {
+    return params->max_alive >= 1 &&
+        params->max_total >= 0 &&
+        params->min_radius >= 1 &&
+        params->padding >= 0 &&
+        params->grow_by >= 1;
+}
+
+void cf_default_params(cf_params *params) {
+    params->max_alive = 100;
+    params->max_total = 65535;
+    params->min_radius = 5;
+    params->padding = 2;
+    params->grow_by = 1;
+    params->edge_color = (cf_color){0x30, 0x30, 0x30};
+    params->seed = 1;
+}
+
+cf_result cf_create(cf_context **ctx, const cf_params *params,
+        const cf_allocator *allocator) {
+    if (!ctx || !params || !params_valid(params)) {
+        return CF_ERR_INVALID;
+    }
+    if (!allocator) {
+        allocator = &default_allocator;
+    } else if (!allocator->alloc || !allocator->realloc || !allocator->free) {
+        return CF_ERR_INVALID;
+    }
+
+    cf_context *c = allocator->alloc(sizeof(*c), allocator->user);
+    if (!c) {
+        return CF_ERR_NOMEM;
+    }
+    memset(c, 0, sizeof(*c));
+    c->params = *params;
+    c->allocator = *allocator;
+    c->rand_state = params->seed;
+
+    *ctx = c;
+    return CF_OK;
+}
+
+void cf_destroy(cf_context *ctx) {
+    if (!ctx) {
+        return;
+    }
+    cf_allocator allocator = ctx->allocator;
+    if (ctx->boxes) {
+        allocator.free(ctx->boxes, ctx->boxes_size * sizeof(*ctx->boxes),
+                allocator.user);
+    }
+    if (ctx->spans) {
+        allocator.free(ctx->spans, 2 * ctx->spans_size * sizeof(int),
+                allocator.user);
+    }
+    if (ctx->damage) {
+        allocator.free(ctx->damage, ctx->damage_size * sizeof(*ctx->damage),
+                allocator.user);
+    }
+    allocator.free(ctx, sizeof(*ctx), allocator.user);
+}
+
+cf_result cf_layout_begin(cf_context *ctx, int width, int height) {
+    const cf_params *params = &ctx->params;
+    const cf_allocator *allocator = &ctx->allocator;
+
+    // there must be room for a circle center inside the padding
+    if (width <= 2*params->padding || height <= 2*params->padding) {
+        return CF_ERR_INVALID;
+    }
+    ctx->width = width;
+    ctx->height = height;
+
+    // allocate boxes storage for as many circles as can fit up front, so
+    // placement does not have to reallocate
+    int boxes_size = estimate_circles(params, width, height);
+    if (ctx->boxes_size < boxes_size) {
+        box *boxes = allocator->realloc(ctx->boxes,
+                ctx->boxes_size * sizeof(*boxes),
+                boxes_size * sizeof(*boxes), allocator->user);
+        if (!boxes) {
+            return CF_ERR_NOMEM;
+        }
+        ctx->boxes = boxes;
+        ctx->boxes_size = boxes_size;
+    }
+
+    ctx->nboxes = 0; // total number of existing boxes
+    ctx->ncolored = 0;
+    ctx->nalive = 0; // number of living boxes
+    ctx->finished = false;
+    ctx->ticks = 0;
+
+    return CF_OK;
+}
+
+// Circle generation algorithm, one growth tick per call
+// Based on XScreenSaver boxfit by jwz
+cf_result cf_layout_step(cf_context *ctx, int *finished) {
+    const cf_params *params = &ctx->params;
+    const cf_allocator *allocator = &ctx->allocator;
+
+    if (!ctx->width) {
+        return CF_ERR_STATE;
+    }
+    if (ctx->finished) {
+        *finished = true;
+        return CF_OK;
+    }
+
+    // grow boxes if possible
+    for (int i = 0; i < ctx->nboxes; i++) {
+        box *b = &ctx->boxes[i];
+
+        if (!b->alive) {
+            // don't keep growing, it's already dead
+        } else if (!box_legal(ctx, b, params->grow_by + params->padding)) {
+            // can't grow anymore, make it dead
+            b->alive = false;
+            ctx->nalive--;
+        } else {
+            // grow the box
+            b->r += params->grow_by;
+        }
+    }
+
+    // add new boxes if needed
+    while (ctx->nalive < params->max_alive) {
+        if (ctx->boxes_size <= ctx->nboxes) {
+            // need to reallocate
+            int boxes_size = (1.5 * ctx->boxes_size) + ctx->nboxes;
+            box *boxes = allocator->realloc(ctx->boxes,
+                    ctx->boxes_size * sizeof(*boxes),
+                    boxes_size * sizeof(*boxes), allocator->user);
+            if (!boxes) {
+                return CF_ERR_NOMEM;
+            }
+            ctx->boxes = boxes;
+            ctx->boxes_size = boxes_size;
+        }
+
+        // try to add a new box 100 times
+        box *b = &ctx->boxes[ctx->nboxes];
+        b->alive = false;
+        b->drawn_r = 0;
+        for (int i = 0; i < 100; i++) {
+            b->x = params->padding +
+                (rand_r(&ctx->rand_state) % (ctx->width - 2*params->padding));
+            b->y = params->padding +
+                (rand_r(&ctx->rand_state) % (ctx->height - 2*params->padding));
+            b->r = params->min_radius;
+
+            if (box_legal(ctx, b, params->padding)) {
+                // successfully found a spot
+                b->alive = true;
+                ctx->nboxes++;
+                ctx->nalive++;
+                break;
+            }
+        }
+        if (!b->alive || ctx->nboxes >= params->max_total) {
+            // unable to find a new box to add, or reached max
+            ctx->finished = true;
+            break;
+        }
+    }
+
+    *finished = ctx->finished;
+    return CF_OK;
+}
+
+cf_result cf_layout(cf_context *ctx, int width, int height) {
+    cf_result result = cf_layout_begin(ctx, width, height);
+    int finished = false;
+    while (result == CF_OK && !finished) {
+        result = cf_layout_step(ctx, &finished);
+    }
+    return result;
+}
+
+int cf_circle_count(const cf_context *ctx) {
+    return ctx->nboxes;
+}
+
+cf_result cf_colorize(cf_context *ctx, const cf_image *image) {
+    if (!ctx->width) {
+        return CF_ERR_STATE;
+    }
+    if (image->width != ctx->width || image->height != ctx->height) {
+        return CF_ERR_INVALID;
+    }
+    sampler getpixel = select_sampler(image->format);
+    if (!getpixel || !image->pixels ||
+            image->stride < image->width * pixel_size(image->format)) {
+        return CF_ERR_INVALID;
+    }
+
+    for (int i = ctx->ncolored; i < ctx->nboxes; i++) {
+        box *b = &ctx->boxes[i];
+        b->fill = getpixel(image, b->x, b->y);
+    }
+    ctx->ncolored = ctx->nboxes;
+
+    return CF_OK;
+}
+
+// Each pixel belongs to exactly one row range and boxes are drawn in order
+// within it, so rendering band by band gives the same image as all at once.
+cf_result cf_render(const cf_context *ctx, void *buf, size_t stride,
+        int ymin, int ymax) {
+    if (!ctx->width || ctx->ncolored != ctx->nboxes) {
+        return CF_ERR_STATE;
+    }
+    if (!buf || ymin < 0 || ymax > ctx->height || ymin > ymax ||
+            stride < ctx->width * sizeof(pixel)) {
+        return CF_ERR_INVALID;
+    }
+
+    canvas cv = {buf, stride, ymin, ymax};
+
+    // clear to black background
+    for (int y = ymin; y < ymax; y++) {
+        memset(cv.buf + y*stride, 0, ctx->width * sizeof(pixel));
+    }
+
+    for (int i = 0; i < ctx->nboxes; i++) {
+        const box *b = &ctx->boxes[i];
+        if (b->y + b->r < ymin || b->y - b->r >= ymax) {
+            continue;
+        }
+        draw_box(&cv, b, ctx->params.edge_color);
+    }
+
+    return CF_OK;
+}
+
+cf_result cf_render_tick(cf_context *ctx, void *buf, size_t stride,
+        const cf_rect **damage, int *ndamage) {
+    const cf_allocator *allocator = &ctx->allocator;
+
+    if (!ctx->width || ctx->ncolored != ctx->nboxes) {
+        return CF_ERR_STATE;
+    }
+    // circles touching with no padding share edge pixels, which redrawing
+    // only the new rings would overwrite out of order
+    if (!buf || stride < ctx->width * sizeof(pixel) || ctx->params.padding < 1) {
+        return CF_ERR_INVALID;
+    }
+
+    // at most one rectangle per box, or one for the whole first frame
+    if (ctx->damage_size < ctx->nboxes + 1) {
+        int damage_size = MAX(ctx->nboxes + 1, 2 * ctx->damage_size);
+        cf_rect *damage_rects = allocator->realloc(ctx->damage,
+                ctx->damage_size * sizeof(*damage_rects),
+                damage_size * sizeof(*damage_rects), allocator->user);
+        if (!damage_rects) {
+            return CF_ERR_NOMEM;
+        }
+        ctx->damage = damage_rects;
+        ctx->damage_size = damage_size;
+    }
+    int n = 0;
+
+    canvas cv = {buf, stride, 0, ctx->height};
+    bool first = ctx->ticks == 0;
+    if (first) {
+        // clear to black background
+        for (int y = 0; y < ctx->height; y++) {
+            memset(cv.buf + y*stride, 0, ctx->width * sizeof(pixel));
+        }
+        ctx->damage[n++] = (cf_rect){0, 0, ctx->width, ctx->height};
+    }
+
+    for (int i = 0; i < ctx->nboxes; i++) {
+        box *b = &ctx->boxes[i];
+        if (b->drawn_r == b->r) {
+            continue;
+        }
+
+        if (b->drawn_r == 0) {
+            draw_box(&cv, b, ctx->params.edge_color);
+        } else {
+            if (!reserve_spans(ctx, b->r)) {
+                return CF_ERR_NOMEM;
+            }
+            draw_box_ring(ctx, &cv, b, ctx->params.edge_color);
+        }
+        b->drawn_r = b->r;
+
+        if (!first) {
+            ctx->damage[n++] = (cf_rect){b->x - b->r, b->y - b->r,
+                2*b->r + 1, 2*b->r + 1};
+        }
+    }
+    ctx->ticks++;
+
+    *damage = ctx->damage;
+    *ndamage = n;
+    return CF_OK;
+}
+
+cf_result cf_arena_create(cf_arena **arena) {
+    cf_arena *a = malloc(sizeof(*a));
+    if (!a) {
+        return CF_ERR_NOMEM;
+    }
+    if (pthread_mutex_init(&a->lock, NULL)) {
+        free(a);
+        return CF_ERR_NOMEM;
+    }
+    a->regions = NULL;
+
+    *arena = a;
+    return CF_OK;
+}
+
+void *cf_arena_alloc(cf_arena *arena, size_t size) {
+    size = ALIGN_UP(MAX(size, 1), ARENA_ALIGN);
+    pthread_mutex_lock(&arena->lock);
+
+    // first region with room, so memory kept by cf_arena_reset is reused
+    arena_region *r;
+    for (r = arena->regions; r; r = r->next) {
+        if (r->size - r->used >= size) {
+            break;
+        }
+    }
+
+    if (!r) {
+        // region header lives at the start of its own mapping
+        // only frame-sized requests are worth a huge page, which would
+        // otherwise be taken from the reserved pool for a few small arrays
+        size_t header = ALIGN_UP(sizeof(*r), ARENA_ALIGN);
+        size_t map_size;
+        uint8_t *map;
+        if (size >= HUGE_PAGE_SIZE) {
+            map_size = ALIGN_UP(header + size, HUGE_PAGE_SIZE);
+            map = map_huge(map_size);
+        } else {
+            map_size = ALIGN_UP(header + size, SMALL_REGION_SIZE);
+            map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map == MAP_FAILED) {
+                map = NULL;
+            }
+        }
+        if (!map) {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        r = (arena_region *)map;
+        r->base = map;
+        r->size = map_size;
+        r->used = header;
+        r->last = header;
+        r->next = arena->regions;
+        arena->regions = r;
+    }
+
+    void *ptr = r->base + r->used;
+    r->last = r->used;
+    r->used += size;
+
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+void cf_arena_allocator(cf_arena *arena, cf_allocator *allocator) {
+    allocator->alloc = arena_alloc;
+    allocator->realloc = arena_realloc;
+    allocator->free = arena_free;
+    allocator->user = arena;
+}
+
+void cf_arena_reset(cf_arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    for (arena_region *r = arena->regions; r; r = r->next) {
+        r->used = ALIGN_UP(sizeof(*r), ARENA_ALIGN);
+        r->last = r->used;
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void cf_arena_destroy(cf_arena *arena) {
+    if (!arena) {
+        return;
+    }
+    arena_region *r = arena->regions;
+    while (r) {
+        arena_region *next = r->next;
+        munmap(r->base, r->size);
+        r = next;
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+const char *cf_strerror(cf_result result) {
+    switch (result) {
+        case CF_OK:
+            return "Success";
+        case CF_ERR_NOMEM:
+            return "Out of memory";
+        case CF_ERR_INVALID:
+            return "Invalid argument";
+        case CF_ERR_STATE:
+            return "Called out of order";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,162 @@
+#ifndef LIBCIRCLEFIT_H
+#define LIBCIRCLEFIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libcirclefit: circle placement, coloring and rendering without global state.
+//
+// All state lives in an opaque cf_context, so several contexts can be used at
+// once, e.g. one per thread. A single context must not be used from several
+// threads at the same time, except that cf_render may be called concurrently
+// on disjoint row ranges once coloring is done.
+//
+// Typical use:
+//   cf_create(&ctx, &params, NULL);
+//   cf_layout(ctx, width, height);
+//   cf_colorize(ctx, &image);
+//   cf_render(ctx, buf, stride, 0, height);
+//   cf_destroy(ctx);
+//
+// For an animation, place circles one growth tick at a time instead:
+//   cf_layout_begin(ctx, width, height);
+//   do {
+//       cf_layout_step(ctx, &finished);
+//       cf_colorize(ctx, &image);
+//       cf_render_tick(ctx, buf, stride, &damage, &ndamage);
+//   } while (!finished);
+
+typedef struct cf_context cf_context;
+
+typedef enum {
+    CF_OK = 0,
+    CF_ERR_NOMEM,   // an allocation failed
+    CF_ERR_INVALID, // an argument or parameter is out of range
+    CF_ERR_STATE,   // called out of order, e.g. cf_render before cf_colorize
+} cf_result;
+
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} cf_color;
+
+// Circle placement parameters, see cf_default_params for the defaults
+typedef struct {
+    int max_alive;       // max number of live circles at a time, at least 1
+    int max_total;       // max total number of circles, at least 0
+    int min_radius;      // minimum radius of a circle, at least 1
+    int padding;         // padding between circles and on edges, at least 0
+    int grow_by;         // amount to increase radius each tick, at least 1
+    cf_color edge_color; // color of the edge of circles
+    unsigned int seed;   // random seed for placement
+} cf_params;
+
+// Memory allocation callbacks, passed the user pointer on every call
+// Sizes are passed back to realloc and free for allocators that need them.
+typedef struct {
+    void *(*alloc)(size_t size, void *user);
+    void *(*realloc)(void *ptr, size_t old_size, size_t new_size, void *user);
+    void (*free)(void *ptr, size_t size, void *user);
+    void *user;
+} cf_allocator;
+
+// Layout of source image pixels in memory
+typedef enum {
+    CF_PIXEL_RGB24,    // bytes R, G, B
+    CF_PIXEL_RGBA32,   // bytes R, G, B, A
+    CF_PIXEL_BGRA32,   // bytes B, G, R, A
+    CF_PIXEL_XRGB8888, // native-endian 32-bit word 0xXXRRGGBB
+} cf_pixel_format;
+
+// Rectangle of changed pixels
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} cf_rect;
+
+// Source image used to color circles, borrowed for the duration of cf_colorize
+typedef struct {
+    const void *pixels;
+    int width;
+    int height;
+    size_t stride; // bytes per row
+    cf_pixel_format format;
+} cf_image;
+
+// Fill params with the default parameters
+void cf_default_params(cf_params *params);
+
+// Create a context in *ctx
+// allocator may be NULL to use malloc, and is copied into the context.
+// Otherwise all three of its callbacks must be set.
+cf_result cf_create(cf_context **ctx, const cf_params *params,
+        const cf_allocator *allocator);
+
+// Free a context and everything it allocated
+void cf_destroy(cf_context *ctx);
+
+// Place circles on a width x height canvas, replacing any earlier layout
+cf_result cf_layout(cf_context *ctx, int width, int height);
+
+// Start placing circles on a width x height canvas, replacing any earlier
+// layout, without placing any yet
+cf_result cf_layout_begin(cf_context *ctx, int width, int height);
+
+// Run one growth tick of placement: grow the live circles and add new ones
+// Sets *finished once no more circles fit; later calls do nothing.
+cf_result cf_layout_step(cf_context *ctx, int *finished);
+
+// Number of circles placed by the last cf_layout
+int cf_circle_count(const cf_context *ctx);
+
+// Color each circle placed since the last call from the pixel of image at its
+// center. The image must have the size given to cf_layout.
+cf_result cf_colorize(cf_context *ctx, const cf_image *image);
+
+// Render rows [ymin, ymax) as 24bpp RGB into buf, which holds row 0 at its
+// start and stride bytes per row. The rows are cleared to black first.
+cf_result cf_render(const cf_context *ctx, void *buf, size_t stride,
+        int ymin, int ymax);
+
+// Draw the changes since the last tick into buf, which must hold the frame
+// drawn by the previous call since cf_layout_begin. The first call clears buf.
+// Only the new outer ring of grown circles and newly placed circles are drawn.
+// The frame matches cf_render. Padding must be at least 1, as touching circles
+// share pixels that the incremental drawing would overwrite out of order.
+// Sets *damage to the rectangles changed, owned by the context and valid until
+// the next call, and *ndamage to their number.
+cf_result cf_render_tick(cf_context *ctx, void *buf, size_t stride,
+        const cf_rect **damage, int *ndamage);
+
+// Run-scoped memory arena, freed all at once
+// Allocations of at least 2 MiB come from huge-page-aligned mappings, backed by
+// explicit or transparent huge pages where available, so frame-sized buffers
+// take few page faults and TLB entries. Smaller ones share regular pages.
+// The arena itself is safe to use from several threads.
+typedef struct cf_arena cf_arena;
+
+// Create an empty arena in *arena
+cf_result cf_arena_create(cf_arena **arena);
+
+// Allocate size bytes, aligned to a cache line and not cleared
+// Returns NULL if out of memory.
+void *cf_arena_alloc(cf_arena *arena, size_t size);
+
+// Fill allocator with callbacks allocating from arena, for cf_create
+// Freeing through it does nothing until the arena is reset or destroyed.
+void cf_arena_allocator(cf_arena *arena, cf_allocator *allocator);
+
+// Free all allocations at once, keeping the memory mapped for the next job
+// Contexts allocated from the arena must not be used afterwards.
+void cf_arena_reset(cf_arena *arena);
+
+// Free all allocations and unmap the arena's memory
+void cf_arena_destroy(cf_arena *arena);
+
+// Short description of a result code
+const char *cf_strerror(cf_result result);
+
+#endif
@@ -42,6 +42,38 @@ echo "Test ${testno}: PNG from .asd file, png format specified"
 maim -u -f png input.asd; ./${NAME} -i input.asd -f png | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
 testno=$((testno+1))
 
+echo
+echo "RAW INPUT FORMATS"
+
+echo "Test ${testno}: RGB24 from stdin, raw format specified"
+maim -u -f bmp | convert bmp:- RGB:- | ./${NAME} -f raw -s ${RESOLUTION} | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
+echo "Test ${testno}: RGB24 from .raw file, raw format guessed"
+maim -u -f bmp | convert bmp:- RGB:input.raw; ./${NAME} -i input.raw -s ${RESOLUTION} | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
+echo "Test ${testno}: BGRA from .bgra file, bgra format specified"
+maim -u -f bmp | convert bmp:- BGRA:input.bgra; ./${NAME} -i input.bgra -f bgra -s ${RESOLUTION} | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
+echo "Test ${testno}: XRGB8888 from fd, xrgb8888 format specified"
+maim -u -f bmp | convert bmp:- BGRA:input.bgra; ./${NAME} -d 3 -f xrgb8888 -s ${RESOLUTION} 3<input.bgra | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
+echo "Test ${testno}: BGRA from memfd, bgra format specified"
+maim -u -f bmp | convert bmp:- BGRA:- | python3 -c '
+import os, sys
+fd = os.memfd_create("circlefit", 0)
+os.write(fd, sys.stdin.buffer.read())
+os.execvp(sys.argv[1], sys.argv[1:] + ["-d", str(fd)])
+' ./${NAME} -f bgra -s ${RESOLUTION} | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
+echo "Test ${testno}: BMP from fd, bmp format default"
+maim -u input.bmp; ./${NAME} -d 3 3<input.bmp | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}.png
+testno=$((testno+1))
+
 echo
 echo "OUTPUT FORMATS"
 
@@ -81,3 +113,14 @@ echo "Test ${testno}: PNG to .asd file, png format specified"
 maim -u -f bmp | ./${NAME} -o out${testno}.asd -F png
 testno=$((testno+1))
 
+
+echo
+echo "ANIMATION"
+
+echo "Test ${testno}: raw frames to stdout"
+maim -u -f bmp | ./${NAME} -A | convert -size ${RESOLUTION} -depth 8 RGB:- out${testno}-%d.png
+testno=$((testno+1))
+
+echo "Test ${testno}: raw frames to .raw file with damage file"
+maim -u -f bmp | ./${NAME} -A -o out${testno}.raw -D out${testno}.damage; convert -size ${RESOLUTION} -depth 8 RGB:out${testno}.raw out${testno}-%d.png
+testno=$((testno+1))
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "libcirclefit.h"
+
+#define WIDTH 320
+#define HEIGHT 200
+#define STRIDE (WIDTH * 3)
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// Source image, a gradient so that circles get different colors
+uint8_t source[HEIGHT][WIDTH][3];
+
+cf_image source_image(void) {
+    cf_image image = {source, WIDTH, HEIGHT, STRIDE, CF_PIXEL_RGB24};
+    return image;
+}
+
+void fill_source(void) {
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            source[y][x][0] = x * 255 / WIDTH;
+            source[y][x][1] = y * 255 / HEIGHT;
+            source[y][x][2] = (x + y) & 0xff;
+        }
+    }
+}
+
+cf_params test_params(void) {
+    cf_params params;
+    cf_default_params(&params);
+    params.seed = 1234;
+    return params;
+}
+
+// Lay out, color and render a whole image with ctx into buf
+cf_result render_image(cf_context *ctx, uint8_t *buf) {
+    cf_image image = source_image();
+    cf_result result = cf_layout(ctx, WIDTH, HEIGHT);
+    if (result == CF_OK) {
+        result = cf_colorize(ctx, &image);
+    }
+    if (result == CF_OK) {
+        result = cf_render(ctx, buf, STRIDE, 0, HEIGHT);
+    }
+    return result;
+}
+
+typedef struct {
+    uint8_t *buf;
+    cf_result result;
+} job;
+
+// Render an image with a context of its own, as one of several threads
+void *render_job(void *arg) {
+    job *j = arg;
+    cf_params params = test_params();
+    cf_context *ctx;
+    j->result = cf_create(&ctx, &params, NULL);
+    if (j->result == CF_OK) {
+        j->result = render_image(ctx, j->buf);
+        cf_destroy(ctx);
+    }
+    return NULL;
+}
+
+// Contexts with the same seed on separate threads give the same image
+void test_concurrent_contexts(void) {
+    job jobs[2];
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        jobs[i].buf = malloc(STRIDE * HEIGHT);
+        pthread_create(&threads[i], NULL, render_job, &jobs[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(jobs[i].result == CF_OK);
+    }
+    CHECK(memcmp(jobs[0].buf, jobs[1].buf, STRIDE * HEIGHT) == 0);
+    free(jobs[0].buf);
+    free(jobs[1].buf);
+}
+
+// Rendering disjoint row ranges gives the same image as one full render
+void test_banded_render(void) {
+    cf_params params = test_params();
+    cf_context *ctx;
+    CHECK(cf_create(&ctx, &params, NULL) == CF_OK);
+
+    uint8_t *full = malloc(STRIDE * HEIGHT);
+    uint8_t *banded = malloc(STRIDE * HEIGHT);
+    CHECK(render_image(ctx, full) == CF_OK);
+    CHECK(cf_circle_count(ctx) > 0);
+
+    int split = HEIGHT / 3;
+    CHECK(cf_render(ctx, banded, STRIDE, split, HEIGHT) == CF_OK);
+    CHECK(cf_render(ctx, banded, STRIDE, 0, split) == CF_OK);
+    CHECK(memcmp(full, banded, STRIDE * HEIGHT) == 0);
+
+    free(full);
+    free(banded);
+    cf_destroy(ctx);
+}
+
+// Is pixel (x, y) inside one of the damage rectangles?
+int in_damage(const cf_rect *damage, int ndamage, int x, int y) {
+    for (int i = 0; i < ndamage; i++) {
+        const cf_rect *r = &damage[i];
+        if (x >= r->x && x < r->x + r->width && y >= r->y && y < r->y + r->height) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Every incremental frame matches a full render of the same layout, and
+// only changes pixels inside its damage rectangles
+void test_render_tick(void) {
+    struct {
+        int min_radius, padding, grow_by;
+    } cases[] = {
+        {5, 2, 1},
+        {1, 1, 1},
+        {3, 1, 4},
+        {8, 5, 2},
+    };
+    uint8_t *frame = malloc(STRIDE * HEIGHT);
+    uint8_t *prev = malloc(STRIDE * HEIGHT);
+    uint8_t *full = malloc(STRIDE * HEIGHT);
+    cf_image image = source_image();
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        cf_params params = test_params();
+        params.seed += i;
+        params.min_radius = cases[i].min_radius;
+        params.padding = cases[i].padding;
+        params.grow_by = cases[i].grow_by;
+
+        cf_context *ctx;
+        CHECK(cf_create(&ctx, &params, NULL) == CF_OK);
+        CHECK(cf_layout_begin(ctx, WIDTH, HEIGHT) == CF_OK);
+
+        // stale contents, which the first frame must clear
+        memset(frame, 0xff, STRIDE * HEIGHT);
+
+        int finished = 0;
+        int mismatched = 0;
+        int undamaged = 0;
+        for (int tick = 0; !finished; tick++) {
+            memcpy(prev, frame, STRIDE * HEIGHT);
+            const cf_rect *damage;
+            int ndamage;
+            CHECK(cf_layout_step(ctx, &finished) == CF_OK);
+            CHECK(cf_colorize(ctx, &image) == CF_OK);
+            CHECK(cf_render_tick(ctx, frame, STRIDE, &damage, &ndamage) == CF_OK);
+
+            if (tick == 0) {
+                CHECK(ndamage == 1);
+                CHECK(damage[0].x == 0 && damage[0].y == 0 &&
+                        damage[0].width == WIDTH && damage[0].height == HEIGHT);
+            }
+
+            CHECK(cf_render(ctx, full, STRIDE, 0, HEIGHT) == CF_OK);
+            mismatched += memcmp(frame, full, STRIDE * HEIGHT) != 0;
+
+            for (int y = 0; y < HEIGHT; y++) {
+                for (int x = 0; x < WIDTH; x++) {
+                    size_t at = y * STRIDE + x * 3;
+                    if (memcmp(frame + at, prev + at, 3) != 0 &&
+                            !in_damage(damage, ndamage, x, y)) {
+                        undamaged++;
+                    }
+                }
+            }
+        }
+        CHECK(mismatched == 0);
+        CHECK(undamaged == 0);
+
+        cf_destroy(ctx);
+    }
+
+    // padding 0 is refused rather than drawn inexactly
+    cf_params params = test_params();
+    params.padding = 0;
+    cf_context *ctx;
+    CHECK(cf_create(&ctx, &params, NULL) == CF_OK);
+    CHECK(cf_layout(ctx, WIDTH, HEIGHT) == CF_OK);
+    CHECK(cf_colorize(ctx, &image) == CF_OK);
+    const cf_rect *damage;
+    int ndamage;
+    CHECK(cf_render_tick(ctx, frame, STRIDE, &damage, &ndamage) == CF_ERR_INVALID);
+    cf_destroy(ctx);
+
+    free(frame);
+    free(prev);
+    free(full);
+}
+
+// Malloc allocator that counts calls made through it
+int allocations = 0;
+
+void *counting_alloc(size_t size, void *user) {
+    (void)user;
+    allocations++;
+    return malloc(size);
+}
+
+void *counting_realloc(void *ptr, size_t old_size, size_t new_size, void *user) {
+    (void)old_size;
+    (void)user;
+    allocations++;
+    return realloc(ptr, new_size);
+}
+
+void counting_free(void *ptr, size_t size, void *user) {
+    (void)size;
+    (void)user;
+    free(ptr);
+}
+
+// Calls out of order or with bad sizes are refused
+void test_errors(void) {
+    cf_params params = test_params();
+    cf_context *ctx;
+    CHECK(cf_create(&ctx, &params, NULL) == CF_OK);
+
+    uint8_t *buf = malloc(STRIDE * HEIGHT);
+    CHECK(cf_render(ctx, buf, STRIDE, 0, HEIGHT) == CF_ERR_STATE);
+
+    // render before colorize
+    CHECK(cf_layout(ctx, WIDTH, HEIGHT) == CF_OK);
+    CHECK(cf_render(ctx, buf, STRIDE, 0, HEIGHT) == CF_ERR_STATE);
+
+    // image size differs from the layout
+    cf_image image = source_image();
+    image.width--;
+    CHECK(cf_colorize(ctx, &image) == CF_ERR_INVALID);
+
+    // missing pixels, or rows shorter than the image width
+    image = source_image();
+    image.pixels = NULL;
+    CHECK(cf_colorize(ctx, &image) == CF_ERR_INVALID);
+    image = source_image();
+    image.stride = WIDTH * 3 - 1;
+    CHECK(cf_colorize(ctx, &image) == CF_ERR_INVALID);
+    image.format = CF_PIXEL_BGRA32;
+    image.stride = WIDTH * 3;
+    CHECK(cf_colorize(ctx, &image) == CF_ERR_INVALID);
+
+    // missing output buffer
+    image = source_image();
+    CHECK(cf_colorize(ctx, &image) == CF_OK);
+    CHECK(cf_render(ctx, NULL, STRIDE, 0, HEIGHT) == CF_ERR_INVALID);
+
+    // canvas with no room inside the padding
+    CHECK(cf_layout(ctx, 2 * params.padding, HEIGHT) == CF_ERR_INVALID);
+    CHECK(cf_layout(ctx, WIDTH, 2 * params.padding) == CF_ERR_INVALID);
+
+    cf_context *bad;
+    cf_allocator no_free = {counting_alloc, counting_realloc, NULL, NULL};
+    CHECK(cf_create(&bad, &params, &no_free) == CF_ERR_INVALID);
+
+    params.min_radius = 0;
+    CHECK(cf_create(&bad, &params, NULL) == CF_ERR_INVALID);
+
+    free(buf);
+    cf_destroy(ctx);
+}
+
+// Boxes are allocated up front for as many circles as can fit, so placement
+// never grows them
+void test_capacity_estimate(void) {
+    cf_allocator allocator = {counting_alloc, counting_realloc, counting_free, NULL};
+    struct {
+        int min_radius, padding, max_alive, max_total;
+    } cases[] = {
+        {5, 2, 100, 65535},
+        {1, 0, 1000, 65535},
+        {1, 1, 1000, 65535},
+        {3, 0, 20, 50},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        cf_params params = test_params();
+        params.min_radius = cases[i].min_radius;
+        params.padding = cases[i].padding;
+        params.max_alive = cases[i].max_alive;
+        params.max_total = cases[i].max_total;
+
+        cf_context *ctx;
+        CHECK(cf_create(&ctx, &params, &allocator) == CF_OK);
+        CHECK(cf_layout_begin(ctx, WIDTH, HEIGHT) == CF_OK);
+
+        allocations = 0;
+        int finished = 0;
+        while (!finished) {
+            CHECK(cf_layout_step(ctx, &finished) == CF_OK);
+        }
+        CHECK(allocations == 0);
+        CHECK(cf_circle_count(ctx) > 0);
+
+        cf_destroy(ctx);
+    }
+}
+
+// A job allocated from an arena can be run again after a reset, with the
+// same result as a fresh run
+void test_arena_reuse(void) {
+    uint8_t *fresh = malloc(STRIDE * HEIGHT);
+    job j = {fresh, CF_OK};
+    render_job(&j);
+    CHECK(j.result == CF_OK);
+
+    cf_arena *arena;
+    CHECK(cf_arena_create(&arena) == CF_OK);
+    cf_allocator allocator;
+    cf_arena_allocator(arena, &allocator);
+    cf_params params = test_params();
+
+    for (int run = 0; run < 2; run++) {
+        uint8_t *buf = cf_arena_alloc(arena, STRIDE * HEIGHT);
+        CHECK(buf != NULL);
+        cf_context *ctx;
+        CHECK(cf_create(&ctx, &params, &allocator) == CF_OK);
+        CHECK(render_image(ctx, buf) == CF_OK);
+        CHECK(memcmp(buf, fresh, STRIDE * HEIGHT) == 0);
+        cf_destroy(ctx);
+        cf_arena_reset(arena);
+    }
+
+    cf_arena_destroy(arena);
+    free(fresh);
+}
+
+int main(void) {
+    fill_source();
+
+    test_concurrent_contexts();
+    test_banded_render();
+    test_errors();
+    test_render_tick();
+    test_capacity_estimate();
+    test_arena_reuse();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All library tests passed\n");
+    return 0;
+}